@@ -1,7 +1,15 @@
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <cstdlib>
 
@@ -52,140 +60,299 @@ struct Work {
     uint mask[4];
     uint data[16];
     uint mutable_index;
-    ulong count; // unused
+    ulong count;
 };
 
+#ifndef MD5RUSH_VECTOR_WIDTH
+#define MD5RUSH_VECTOR_WIDTH 1
+#endif
+#ifndef MD5RUSH_ITERATIONS
+#define MD5RUSH_ITERATIONS 1
+#endif
+
+#if MD5RUSH_VECTOR_WIDTH == 1
+typedef uint vector_t;
+#define LANES 0u
+#define ANY_ZERO(X) ((X) == 0)
+#define STORE(X, P) (*(P) = (X))
+#elif MD5RUSH_VECTOR_WIDTH == 2
+typedef uint2 vector_t;
+#define LANES ((uint2)(0, 1))
+#define ANY_ZERO(X) any((X) == 0)
+#define STORE(X, P) vstore2((X), 0, (P))
+#elif MD5RUSH_VECTOR_WIDTH == 4
+typedef uint4 vector_t;
+#define LANES ((uint4)(0, 1, 2, 3))
+#define ANY_ZERO(X) any((X) == 0)
+#define STORE(X, P) vstore4((X), 0, (P))
+#elif MD5RUSH_VECTOR_WIDTH == 8
+typedef uint8 vector_t;
+#define LANES ((uint8)(0, 1, 2, 3, 4, 5, 6, 7))
+#define ANY_ZERO(X) any((X) == 0)
+#define STORE(X, P) vstore8((X), 0, (P))
+#elif MD5RUSH_VECTOR_WIDTH == 16
+typedef uint16 vector_t;
+#define LANES ((uint16)(0, 1, 2, 3, 4, 5, 6, 7, \
+            8, 9, 10, 11, 12, 13, 14, 15))
+#define ANY_ZERO(X) any((X) == 0)
+#define STORE(X, P) vstore16((X), 0, (P))
+#else
+#error "MD5RUSH_VECTOR_WIDTH must be 1, 2, 4, 8 or 16"
+#endif
+
+// Each work-item tries MD5RUSH_ITERATIONS * MD5RUSH_VECTOR_WIDTH
+// consecutive messages; those at or beyond work->count are ignored.
 __kernel void md5rush(__constant struct Work *work,
         volatile __global uint *found,
         volatile __global uint *index) {
-    uint a = work->init_state[0];
-    uint b = work->init_state[1];
-    uint c = work->init_state[2];
-    uint d = work->init_state[3];
+    const ulong first = get_global_id(0) *
+        (ulong) (MD5RUSH_ITERATIONS * MD5RUSH_VECTOR_WIDTH);
+    for (uint i = 0; i < MD5RUSH_ITERATIONS; i++) {
+        const ulong offset = first + i * MD5RUSH_VECTOR_WIDTH;
+        const vector_t mutation = (uint) offset + LANES;
+        vector_t a = (vector_t) (work->init_state[0]);
+        vector_t b = (vector_t) (work->init_state[1]);
+        vector_t c = (vector_t) (work->init_state[2]);
+        vector_t d = (vector_t) (work->init_state[3]);
 #define MD5_ITERATION(F, G, K, S) \
-    do { \
-        uint f = (F) + a + (K) + work->data[(G)] + \
-            ((G) == work->mutable_index ? get_global_id(0) : 0); \
-        a = d; \
-        d = c; \
-        c = b; \
-        b += (f << (S)) | (f >> (32 - (S))); \
-    } while (0)
-    MD5_ITERATION((b & c) | (~b & d),  0, 3614090360,  7);
-    MD5_ITERATION((b & c) | (~b & d),  1, 3905402710, 12);
-    MD5_ITERATION((b & c) | (~b & d),  2,  606105819, 17);
-    MD5_ITERATION((b & c) | (~b & d),  3, 3250441966, 22);
-    MD5_ITERATION((b & c) | (~b & d),  4, 4118548399,  7);
-    MD5_ITERATION((b & c) | (~b & d),  5, 1200080426, 12);
-    MD5_ITERATION((b & c) | (~b & d),  6, 2821735955, 17);
-    MD5_ITERATION((b & c) | (~b & d),  7, 4249261313, 22);
-    MD5_ITERATION((b & c) | (~b & d),  8, 1770035416,  7);
-    MD5_ITERATION((b & c) | (~b & d),  9, 2336552879, 12);
-    MD5_ITERATION((b & c) | (~b & d), 10, 4294925233, 17);
-    MD5_ITERATION((b & c) | (~b & d), 11, 2304563134, 22);
-    MD5_ITERATION((b & c) | (~b & d), 12, 1804603682,  7);
-    MD5_ITERATION((b & c) | (~b & d), 13, 4254626195, 12);
-    MD5_ITERATION((b & c) | (~b & d), 14, 2792965006, 17);
-    MD5_ITERATION((b & c) | (~b & d), 15, 1236535329, 22);
-    MD5_ITERATION((d & b) | (~d & c),  1, 4129170786,  5);
-    MD5_ITERATION((d & b) | (~d & c),  6, 3225465664,  9);
-    MD5_ITERATION((d & b) | (~d & c), 11,  643717713, 14);
-    MD5_ITERATION((d & b) | (~d & c),  0, 3921069994, 20);
-    MD5_ITERATION((d & b) | (~d & c),  5, 3593408605,  5);
-    MD5_ITERATION((d & b) | (~d & c), 10,   38016083,  9);
-    MD5_ITERATION((d & b) | (~d & c), 15, 3634488961, 14);
-    MD5_ITERATION((d & b) | (~d & c),  4, 3889429448, 20);
-    MD5_ITERATION((d & b) | (~d & c),  9,  568446438,  5);
-    MD5_ITERATION((d & b) | (~d & c), 14, 3275163606,  9);
-    MD5_ITERATION((d & b) | (~d & c),  3, 4107603335, 14);
-    MD5_ITERATION((d & b) | (~d & c),  8, 1163531501, 20);
-    MD5_ITERATION((d & b) | (~d & c), 13, 2850285829,  5);
-    MD5_ITERATION((d & b) | (~d & c),  2, 4243563512,  9);
-    MD5_ITERATION((d & b) | (~d & c),  7, 1735328473, 14);
-    MD5_ITERATION((d & b) | (~d & c), 12, 2368359562, 20);
-    MD5_ITERATION(b ^ c ^ d         ,  5, 4294588738,  4);
-    MD5_ITERATION(b ^ c ^ d         ,  8, 2272392833, 11);
-    MD5_ITERATION(b ^ c ^ d         , 11, 1839030562, 16);
-    MD5_ITERATION(b ^ c ^ d         , 14, 4259657740, 23);
-    MD5_ITERATION(b ^ c ^ d         ,  1, 2763975236,  4);
-    MD5_ITERATION(b ^ c ^ d         ,  4, 1272893353, 11);
-    MD5_ITERATION(b ^ c ^ d         ,  7, 4139469664, 16);
-    MD5_ITERATION(b ^ c ^ d         , 10, 3200236656, 23);
-    MD5_ITERATION(b ^ c ^ d         , 13,  681279174,  4);
-    MD5_ITERATION(b ^ c ^ d         ,  0, 3936430074, 11);
-    MD5_ITERATION(b ^ c ^ d         ,  3, 3572445317, 16);
-    MD5_ITERATION(b ^ c ^ d         ,  6,   76029189, 23);
-    MD5_ITERATION(b ^ c ^ d         ,  9, 3654602809,  4);
-    MD5_ITERATION(b ^ c ^ d         , 12, 3873151461, 11);
-    MD5_ITERATION(b ^ c ^ d         , 15,  530742520, 16);
-    MD5_ITERATION(b ^ c ^ d         ,  2, 3299628645, 23);
-    MD5_ITERATION(c ^ (b | ~d)      ,  0, 4096336452,  6);
-    MD5_ITERATION(c ^ (b | ~d)      ,  7, 1126891415, 10);
-    MD5_ITERATION(c ^ (b | ~d)      , 14, 2878612391, 15);
-    MD5_ITERATION(c ^ (b | ~d)      ,  5, 4237533241, 21);
-    MD5_ITERATION(c ^ (b | ~d)      , 12, 1700485571,  6);
-    MD5_ITERATION(c ^ (b | ~d)      ,  3, 2399980690, 10);
-    MD5_ITERATION(c ^ (b | ~d)      , 10, 4293915773, 15);
-    MD5_ITERATION(c ^ (b | ~d)      ,  1, 2240044497, 21);
-    MD5_ITERATION(c ^ (b | ~d)      ,  8, 1873313359,  6);
-    MD5_ITERATION(c ^ (b | ~d)      , 15, 4264355552, 10);
-    MD5_ITERATION(c ^ (b | ~d)      ,  6, 2734768916, 15);
-    MD5_ITERATION(c ^ (b | ~d)      , 13, 1309151649, 21);
-    MD5_ITERATION(c ^ (b | ~d)      ,  4, 4149444226,  6);
-    MD5_ITERATION(c ^ (b | ~d)      , 11, 3174756917, 10);
-    MD5_ITERATION(c ^ (b | ~d)      ,  2,  718787259, 15);
-    MD5_ITERATION(c ^ (b | ~d)      ,  9, 3951481745, 21);
+        do { \
+            vector_t f = (F) + a + (uint) (K) + work->data[(G)] + \
+                ((G) == work->mutable_index ? mutation : (vector_t) (0)); \
+            a = d; \
+            d = c; \
+            c = b; \
+            b += (f << (S)) | (f >> (32 - (S))); \
+        } while (0)
+        MD5_ITERATION((b & c) | (~b & d),  0, 3614090360,  7);
+        MD5_ITERATION((b & c) | (~b & d),  1, 3905402710, 12);
+        MD5_ITERATION((b & c) | (~b & d),  2,  606105819, 17);
+        MD5_ITERATION((b & c) | (~b & d),  3, 3250441966, 22);
+        MD5_ITERATION((b & c) | (~b & d),  4, 4118548399,  7);
+        MD5_ITERATION((b & c) | (~b & d),  5, 1200080426, 12);
+        MD5_ITERATION((b & c) | (~b & d),  6, 2821735955, 17);
+        MD5_ITERATION((b & c) | (~b & d),  7, 4249261313, 22);
+        MD5_ITERATION((b & c) | (~b & d),  8, 1770035416,  7);
+        MD5_ITERATION((b & c) | (~b & d),  9, 2336552879, 12);
+        MD5_ITERATION((b & c) | (~b & d), 10, 4294925233, 17);
+        MD5_ITERATION((b & c) | (~b & d), 11, 2304563134, 22);
+        MD5_ITERATION((b & c) | (~b & d), 12, 1804603682,  7);
+        MD5_ITERATION((b & c) | (~b & d), 13, 4254626195, 12);
+        MD5_ITERATION((b & c) | (~b & d), 14, 2792965006, 17);
+        MD5_ITERATION((b & c) | (~b & d), 15, 1236535329, 22);
+        MD5_ITERATION((d & b) | (~d & c),  1, 4129170786,  5);
+        MD5_ITERATION((d & b) | (~d & c),  6, 3225465664,  9);
+        MD5_ITERATION((d & b) | (~d & c), 11,  643717713, 14);
+        MD5_ITERATION((d & b) | (~d & c),  0, 3921069994, 20);
+        MD5_ITERATION((d & b) | (~d & c),  5, 3593408605,  5);
+        MD5_ITERATION((d & b) | (~d & c), 10,   38016083,  9);
+        MD5_ITERATION((d & b) | (~d & c), 15, 3634488961, 14);
+        MD5_ITERATION((d & b) | (~d & c),  4, 3889429448, 20);
+        MD5_ITERATION((d & b) | (~d & c),  9,  568446438,  5);
+        MD5_ITERATION((d & b) | (~d & c), 14, 3275163606,  9);
+        MD5_ITERATION((d & b) | (~d & c),  3, 4107603335, 14);
+        MD5_ITERATION((d & b) | (~d & c),  8, 1163531501, 20);
+        MD5_ITERATION((d & b) | (~d & c), 13, 2850285829,  5);
+        MD5_ITERATION((d & b) | (~d & c),  2, 4243563512,  9);
+        MD5_ITERATION((d & b) | (~d & c),  7, 1735328473, 14);
+        MD5_ITERATION((d & b) | (~d & c), 12, 2368359562, 20);
+        MD5_ITERATION(b ^ c ^ d         ,  5, 4294588738,  4);
+        MD5_ITERATION(b ^ c ^ d         ,  8, 2272392833, 11);
+        MD5_ITERATION(b ^ c ^ d         , 11, 1839030562, 16);
+        MD5_ITERATION(b ^ c ^ d         , 14, 4259657740, 23);
+        MD5_ITERATION(b ^ c ^ d         ,  1, 2763975236,  4);
+        MD5_ITERATION(b ^ c ^ d         ,  4, 1272893353, 11);
+        MD5_ITERATION(b ^ c ^ d         ,  7, 4139469664, 16);
+        MD5_ITERATION(b ^ c ^ d         , 10, 3200236656, 23);
+        MD5_ITERATION(b ^ c ^ d         , 13,  681279174,  4);
+        MD5_ITERATION(b ^ c ^ d         ,  0, 3936430074, 11);
+        MD5_ITERATION(b ^ c ^ d         ,  3, 3572445317, 16);
+        MD5_ITERATION(b ^ c ^ d         ,  6,   76029189, 23);
+        MD5_ITERATION(b ^ c ^ d         ,  9, 3654602809,  4);
+        MD5_ITERATION(b ^ c ^ d         , 12, 3873151461, 11);
+        MD5_ITERATION(b ^ c ^ d         , 15,  530742520, 16);
+        MD5_ITERATION(b ^ c ^ d         ,  2, 3299628645, 23);
+        MD5_ITERATION(c ^ (b | ~d)      ,  0, 4096336452,  6);
+        MD5_ITERATION(c ^ (b | ~d)      ,  7, 1126891415, 10);
+        MD5_ITERATION(c ^ (b | ~d)      , 14, 2878612391, 15);
+        MD5_ITERATION(c ^ (b | ~d)      ,  5, 4237533241, 21);
+        MD5_ITERATION(c ^ (b | ~d)      , 12, 1700485571,  6);
+        MD5_ITERATION(c ^ (b | ~d)      ,  3, 2399980690, 10);
+        MD5_ITERATION(c ^ (b | ~d)      , 10, 4293915773, 15);
+        MD5_ITERATION(c ^ (b | ~d)      ,  1, 2240044497, 21);
+        MD5_ITERATION(c ^ (b | ~d)      ,  8, 1873313359,  6);
+        MD5_ITERATION(c ^ (b | ~d)      , 15, 4264355552, 10);
+        MD5_ITERATION(c ^ (b | ~d)      ,  6, 2734768916, 15);
+        MD5_ITERATION(c ^ (b | ~d)      , 13, 1309151649, 21);
+        MD5_ITERATION(c ^ (b | ~d)      ,  4, 4149444226,  6);
+        MD5_ITERATION(c ^ (b | ~d)      , 11, 3174756917, 10);
+        MD5_ITERATION(c ^ (b | ~d)      ,  2,  718787259, 15);
+        MD5_ITERATION(c ^ (b | ~d)      ,  9, 3951481745, 21);
 #undef MD5_ITERATION
-    a += work->init_state[0];
-    b += work->init_state[1];
-    c += work->init_state[2];
-    d += work->init_state[3];
-    a &= work->mask[0];
-    b &= work->mask[1];
-    c &= work->mask[2];
-    d &= work->mask[3];
-    if ((a | b | c | d) == 0) {
-        atom_inc(found);
-        atom_min(index, get_global_id(0));
+        a += work->init_state[0];
+        b += work->init_state[1];
+        c += work->init_state[2];
+        d += work->init_state[3];
+        a &= work->mask[0];
+        b &= work->mask[1];
+        c &= work->mask[2];
+        d &= work->mask[3];
+        const vector_t masked_state = a | b | c | d;
+        if (ANY_ZERO(masked_state)) {
+            uint lanes[MD5RUSH_VECTOR_WIDTH];
+            STORE(masked_state, lanes);
+            for (uint j = 0; j < MD5RUSH_VECTOR_WIDTH; j++) {
+                if (lanes[j] == 0 && offset + j < work->count) {
+                    atom_inc(found);
+                    atom_min(index, (uint) (offset + j));
+                }
+            }
+        }
     }
 }
 )";
+
+struct Launch_config {
+    cl_uint vector_width;
+    cl_uint iterations;
+    size_t local_size; // 0 lets the implementation choose
+};
+
+std::ostream &operator << (std::ostream &out, const Launch_config &config) {
+    return out << config.vector_width << ' ' << config.iterations << ' '
+        << config.local_size;
 }
 
-int main() {
-    cl_int err;
+std::istream &operator >> (std::istream &in, Launch_config &config) {
+    return in >> config.vector_width >> config.iterations >> config.local_size;
+}
 
-    cl_device_id device;
-    cl_uint num_devices;
-    err = clGetDeviceIDs(nullptr, CL_DEVICE_TYPE_DEFAULT,
-            1, &device, &num_devices);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Error getting default device: " << err << std::endl;
-        return 1;
-    }
-    if (num_devices == 0) {
-        std::cerr << "No default device found." << std::endl;
-        return 1;
-    }
+constexpr cl_uint vector_widths[] = { 1, 2, 4, 8, 16 };
+constexpr cl_uint iterations[] = { 1, 4, 16, 64 };
+constexpr size_t local_sizes[] = { 0, 32, 64, 128, 256 };
 
-    cl_context context = clCreateContext(nullptr, 1, &device,
-            nullptr, nullptr, &err);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Error creating context: " << err << std::endl;
-        return 1;
+// The one-hash-per-item launch md5rush-opencl used before tuning.
+constexpr Launch_config baseline_config{1, 1, 0};
+
+bool is_candidate(const Launch_config &config) {
+    return std::find(std::begin(vector_widths), std::end(vector_widths),
+                config.vector_width) != std::end(vector_widths) &&
+        std::find(std::begin(iterations), std::end(iterations),
+                config.iterations) != std::end(iterations) &&
+        std::find(std::begin(local_sizes), std::end(local_sizes),
+                config.local_size) != std::end(local_sizes);
+}
+
+bool fits_work_group(const Launch_config &config, cl_kernel kernel,
+        cl_device_id device) {
+    size_t max_local_size;
+    if (clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                sizeof(max_local_size), &max_local_size, nullptr)
+            != CL_SUCCESS)
+        return false;
+    return config.local_size <= max_local_size;
+}
+
+// FNV-1a of the kernel source, so editing it invalidates old tunings.
+constexpr uint32_t kernel_version(const char *source) {
+    uint32_t hash = 2166136261u;
+    for (; *source; source++)
+        hash = (hash ^ uint8_t(*source)) * 16777619u;
+    return hash;
+}
+
+std::string get_device_string(cl_device_id device, cl_device_info param) {
+    size_t size;
+    if (clGetDeviceInfo(device, param, 0, nullptr, &size) != CL_SUCCESS)
+        return "?";
+    std::vector<char> value(size + 1);
+    if (clGetDeviceInfo(device, param, size, value.data(), nullptr)
+            != CL_SUCCESS)
+        return "?";
+    return value.data();
+}
+
+std::string get_platform_string(cl_platform_id platform,
+        cl_platform_info param) {
+    size_t size;
+    if (clGetPlatformInfo(platform, param, 0, nullptr, &size) != CL_SUCCESS)
+        return "?";
+    std::vector<char> value(size + 1);
+    if (clGetPlatformInfo(platform, param, size, value.data(), nullptr)
+            != CL_SUCCESS)
+        return "?";
+    return value.data();
+}
+
+// Tuning results are only valid for the exact device and driver.
+std::string device_identity(cl_device_id device) {
+    cl_platform_id platform;
+    std::string platform_name = "?";
+    if (clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform),
+                &platform, nullptr) == CL_SUCCESS)
+        platform_name = get_platform_string(platform, CL_PLATFORM_NAME);
+    std::string identity = platform_name + " | " +
+        get_device_string(device, CL_DEVICE_VENDOR) + " | " +
+        get_device_string(device, CL_DEVICE_NAME) + " | " +
+        get_device_string(device, CL_DEVICE_VERSION) + " | " +
+        get_device_string(device, CL_DRIVER_VERSION);
+    std::replace(identity.begin(), identity.end(), '\n', ' ');
+    return identity;
+}
+
+std::filesystem::path tuning_path() {
+    if (const char *path = std::getenv("MD5RUSH_OPENCL_TUNE"))
+        return path;
+    if (const char *cache = std::getenv("XDG_CACHE_HOME"))
+        return std::filesystem::path(cache) / "md5rush-opencl.tune";
+    if (const char *home = std::getenv("HOME"))
+        return std::filesystem::path(home) / ".cache" / "md5rush-opencl.tune";
+    return "md5rush-opencl.tune";
+}
+
+// Each line is "<kernel version> <vector width> <iterations> <local size>
+// <identity>", with the kernel version in hex. The last matching line wins.
+std::optional<Launch_config> load_tuning(const std::filesystem::path &path,
+        const std::string &identity) {
+    std::ifstream in(path);
+    std::string line;
+    std::optional<Launch_config> result;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        uint32_t version;
+        Launch_config config;
+        std::string rest;
+        if (!(fields >> std::hex >> version >> std::dec >> config >> std::ws)
+                || !std::getline(fields, rest))
+            continue;
+        if (version == kernel_version(md5rush_source) && rest == identity
+                && is_candidate(config))
+            result = config;
     }
-    Scope_exit release_context([context] {
-        cl_int err2 = clReleaseContext(context);
-        if (err2 != CL_SUCCESS)
-            std::cerr << "Error releasing context: " << err2 << std::endl;
-    });
+    return result;
+}
+
+void save_tuning(const std::filesystem::path &path,
+        const std::string &identity, const Launch_config &config) {
+    std::error_code ec;
+    if (path.has_parent_path())
+        std::filesystem::create_directories(path.parent_path(), ec);
+    std::ofstream out(path, std::ios_base::app);
+    out << std::hex << kernel_version(md5rush_source) << std::dec << ' '
+        << config << ' ' << identity << std::endl;
+    if (!out)
+        std::cerr << "Error saving tuning to " << path << std::endl;
+}
+
+cl_kernel build_md5rush(cl_context context, cl_device_id device,
+        const Launch_config &config) {
+    cl_int err;
 
     const char *sources[] = { md5rush_source };
     cl_program program = clCreateProgramWithSource(
             context, 1, sources, nullptr, &err);
     if (err != CL_SUCCESS) {
         std::cerr << "Error creating program: " << err << std::endl;
-        return 1;
+        return nullptr;
     }
     Scope_exit release_program([program] {
         cl_int err2 = clReleaseProgram(program);
@@ -193,7 +360,11 @@ int main() {
             std::cerr << "Error releasing program: " << err2 << std::endl;
     });
 
-    err = clBuildProgram(program, 0, nullptr, "", nullptr, nullptr);
+    std::string options =
+        "-DMD5RUSH_VECTOR_WIDTH=" + std::to_string(config.vector_width) +
+        " -DMD5RUSH_ITERATIONS=" + std::to_string(config.iterations);
+    err = clBuildProgram(program, 0, nullptr, options.c_str(),
+            nullptr, nullptr);
     if (err != CL_SUCCESS) {
         std::cerr << "Error building program: " << err << std::endl;
 
@@ -202,31 +373,291 @@ int main() {
                 CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
         if (err != CL_SUCCESS) {
             std::cerr << "Error getting build log size: " << err << std::endl;
-            return 1;
+            return nullptr;
         }
 
-        std::vector<char> log(log_size + 1); 
+        std::vector<char> log(log_size + 1);
         err = clGetProgramBuildInfo(program, device,
                 CL_PROGRAM_BUILD_LOG, log_size, log.data(), nullptr);
         if (err != CL_SUCCESS) {
             std::cerr << "Error getting build log: " << err << std::endl;
-            return 1;
+            return nullptr;
         }
 
         std::cerr << log.data() << std::endl;
-        return 1;
+        return nullptr;
     }
 
-    cl_kernel kernel_md5rush = clCreateKernel(program, "md5rush", &err);
+    cl_kernel kernel = clCreateKernel(program, "md5rush", &err);
     if (err != CL_SUCCESS) {
         std::cerr << "Error creating kernel: " << err << std::endl;
-        return 1;
+        return nullptr;
     }
-    Scope_exit release_kernel_md5rush([kernel_md5rush] {
-        cl_int err2 = clReleaseKernel(kernel_md5rush);
+    return kernel;
+}
+
+struct Buffers {
+    cl_mem work;
+    cl_mem found;
+    cl_mem index;
+};
+
+// Returns false (after reporting) on OpenCL errors.
+bool run_md5rush(cl_command_queue cmdqueue, cl_kernel kernel,
+        const Launch_config &config, const Buffers &mem, Work work,
+        uint32_t &found, uint32_t &index) {
+    cl_int err;
+
+    found = 0;
+    index = std::numeric_limits<uint32_t>::max();
+    // Trying duplicate messages is a waste.
+    work.count = std::min(work.count, 0x100000000u);
+
+    err = clEnqueueWriteBuffer(cmdqueue, mem.work,
+            CL_TRUE, 0, sizeof(Work), &work,
+            0, nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error writing to buffer 0: " << err << std::endl;
+        return false;
+    }
+
+    err = clEnqueueWriteBuffer(cmdqueue, mem.found,
+            CL_TRUE, 0, sizeof(uint32_t), &found,
+            0, nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error writing to buffer 1: " << err << std::endl;
+        return false;
+    }
+
+    err = clEnqueueWriteBuffer(cmdqueue, mem.index,
+            CL_TRUE, 0, sizeof(uint32_t), &index,
+            0, nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error writing to buffer 2: " << err << std::endl;
+        return false;
+    }
+
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &mem.work);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error setting argument 0: " << err << std::endl;
+        return false;
+    }
+
+    err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &mem.found);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error setting argument 1: " << err << std::endl;
+        return false;
+    }
+
+    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &mem.index);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error setting argument 2: " << err << std::endl;
+        return false;
+    }
+
+    uint64_t per_item = uint64_t(config.vector_width) * config.iterations;
+    size_t global_size = (work.count + per_item - 1) / per_item;
+    const size_t *local_size = nullptr;
+    if (config.local_size) {
+        global_size = (global_size + config.local_size - 1) /
+            config.local_size * config.local_size;
+        local_size = &config.local_size;
+    }
+    if (global_size) {
+        err = clEnqueueNDRangeKernel(cmdqueue, kernel, 1,
+                nullptr, &global_size, local_size,
+                0, nullptr, nullptr);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Error executing kernel: " << err << std::endl;
+            return false;
+        }
+    }
+
+    err = clEnqueueReadBuffer(cmdqueue, mem.found,
+            CL_TRUE, 0, sizeof(uint32_t), &found,
+            0, nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error reading buffer 1: " << err << std::endl;
+        return false;
+    }
+
+    err = clEnqueueReadBuffer(cmdqueue, mem.index,
+            CL_TRUE, 0, sizeof(uint32_t), &index,
+            0, nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error reading buffer 2: " << err << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A block with a known answer: mask 0xf0 on a, IV as state, zero message.
+Work known_answer_work() {
+    Work work{};
+    work.init_state[0] = 0x67452301;
+    work.init_state[1] = 0xefcdab89;
+    work.init_state[2] = 0x98badcfe;
+    work.init_state[3] = 0x10325476;
+    work.mask[0] = 0xf0;
+    work.count = 100003;
+    return work;
+}
+constexpr uint32_t known_answer_found = 6471;
+constexpr uint32_t known_answer_index = 95;
+
+bool gives_known_answer(cl_command_queue cmdqueue, cl_kernel kernel,
+        const Launch_config &config, const Buffers &mem) {
+    uint32_t found, index;
+    if (!run_md5rush(cmdqueue, kernel, config, mem, known_answer_work(),
+                found, index))
+        return false;
+    return found == known_answer_found && index == known_answer_index;
+}
+
+// Median wall time of several runs on work, after one warm-up run.
+std::optional<double> time_md5rush(cl_command_queue cmdqueue,
+        cl_kernel kernel, const Launch_config &config, const Buffers &mem,
+        const Work &work) {
+    constexpr size_t runs = 5;
+
+    uint32_t found, index;
+    if (!run_md5rush(cmdqueue, kernel, config, mem, work, found, index))
+        return std::nullopt;
+
+    std::array<double, runs> seconds;
+    for (double &s : seconds) {
+        auto start = std::chrono::steady_clock::now();
+        if (!run_md5rush(cmdqueue, kernel, config, mem, work, found, index))
+            return std::nullopt;
+        s = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+    std::nth_element(seconds.begin(), seconds.begin() + runs / 2,
+            seconds.end());
+    return seconds[runs / 2];
+}
+
+// Time every candidate that reproduces the known answer, on a block no
+// message can satisfy and large enough that launch and transfer overhead
+// do not matter. Something other than the baseline is only picked if it
+// is clearly faster.
+std::optional<Launch_config> tune(cl_context context, cl_device_id device,
+        cl_command_queue cmdqueue, const Buffers &mem) {
+    constexpr double min_trial_seconds = 0.05;
+    constexpr double required_speedup = 1.05;
+
+    Work trial{};
+    std::fill(std::begin(trial.mask), std::end(trial.mask), ~uint32_t(0));
+
+    cl_kernel baseline_kernel = build_md5rush(context, device, baseline_config);
+    if (!baseline_kernel)
+        return std::nullopt;
+    Scope_exit release_baseline_kernel([baseline_kernel] {
+        cl_int err2 = clReleaseKernel(baseline_kernel);
         if (err2 != CL_SUCCESS)
             std::cerr << "Error releasing kernel: " << err2 << std::endl;
     });
+    if (!gives_known_answer(cmdqueue, baseline_kernel, baseline_config, mem)) {
+        std::cerr << "Error tuning: wrong answer from the baseline kernel"
+            << std::endl;
+        return std::nullopt;
+    }
+
+    std::optional<double> baseline_seconds;
+    for (trial.count = 1 << 20; ; trial.count *= 2) {
+        baseline_seconds = time_md5rush(cmdqueue, baseline_kernel,
+                baseline_config, mem, trial);
+        if (!baseline_seconds)
+            return std::nullopt;
+        if (*baseline_seconds >= min_trial_seconds
+                || trial.count >= 0x100000000u)
+            break;
+    }
+
+    Launch_config best = baseline_config;
+    double best_seconds = *baseline_seconds;
+    for (cl_uint vector_width : vector_widths) {
+        for (cl_uint iteration : iterations) {
+            Launch_config config{vector_width, iteration, 0};
+            cl_kernel kernel = build_md5rush(context, device, config);
+            if (!kernel)
+                continue;
+            Scope_exit release_kernel([kernel] {
+                cl_int err2 = clReleaseKernel(kernel);
+                if (err2 != CL_SUCCESS)
+                    std::cerr << "Error releasing kernel: " << err2
+                        << std::endl;
+            });
+
+            for (size_t local_size : local_sizes) {
+                config.local_size = local_size;
+                if (!fits_work_group(config, kernel, device))
+                    continue;
+                if (!gives_known_answer(cmdqueue, kernel, config, mem)) {
+                    std::cerr << "Rejected " << config << ": wrong answer"
+                        << std::endl;
+                    continue;
+                }
+
+                std::optional<double> seconds =
+                    time_md5rush(cmdqueue, kernel, config, mem, trial);
+                if (seconds && *seconds * required_speedup
+                        < *baseline_seconds && *seconds < best_seconds) {
+                    best = config;
+                    best_seconds = *seconds;
+                }
+            }
+        }
+    }
+    std::cerr << "Tuned: " << best << " ("
+        << trial.count / best_seconds / 1e6 << " MH/s, baseline "
+        << trial.count / *baseline_seconds / 1e6 << " MH/s)" << std::endl;
+    return best;
+}
+
+void usage(const char *argv0) {
+    std::cerr << "usage: " << argv0 << " [--tune]" << std::endl;
+}
+}
+
+int main(int argc, char **argv) {
+    bool tune_only = false;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--tune") {
+            tune_only = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    cl_int err;
+
+    cl_device_id device;
+    cl_uint num_devices;
+    err = clGetDeviceIDs(nullptr, CL_DEVICE_TYPE_DEFAULT,
+            1, &device, &num_devices);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error getting default device: " << err << std::endl;
+        return 1;
+    }
+    if (num_devices == 0) {
+        std::cerr << "No default device found." << std::endl;
+        return 1;
+    }
+
+    cl_context context = clCreateContext(nullptr, 1, &device,
+            nullptr, nullptr, &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Error creating context: " << err << std::endl;
+        return 1;
+    }
+    Scope_exit release_context([context] {
+        cl_int err2 = clReleaseContext(context);
+        if (err2 != CL_SUCCESS)
+            std::cerr << "Error releasing context: " << err2 << std::endl;
+    });
 
     cl_command_queue cmdqueue = clCreateCommandQueue(context, device, 0, &err);
     if (err != CL_SUCCESS) {
@@ -276,76 +707,52 @@ int main() {
             std::cerr << "Error releasing buffer 2: " << err2 << std::endl;
     });
 
-    Work work;
-    while (std::cin >> work) {
-        uint32_t found = 0, index = std::numeric_limits<uint32_t>::max();
-
-        err = clEnqueueWriteBuffer(cmdqueue, mem_work,
-                CL_TRUE, 0, sizeof(Work), &work,
-                0, nullptr, nullptr);
-        if (err != CL_SUCCESS) {
-            std::cerr << "Error writing to buffer 0: " << err << std::endl;
-            return 1;
-        }
-
-        err = clEnqueueWriteBuffer(cmdqueue, mem_found,
-                CL_TRUE, 0, sizeof(uint32_t), &found,
-                0, nullptr, nullptr);
-        if (err != CL_SUCCESS) {
-            std::cerr << "Error writing to buffer 1: " << err << std::endl;
-            return 1;
-        }
-
-        err = clEnqueueWriteBuffer(cmdqueue, mem_index,
-                CL_TRUE, 0, sizeof(uint32_t), &index,
-                0, nullptr, nullptr);
-        if (err != CL_SUCCESS) {
-            std::cerr << "Error writing to buffer 2: " << err << std::endl;
-            return 1;
-        }
-
-        err = clSetKernelArg(kernel_md5rush, 0, sizeof(cl_mem), &mem_work);
-        if (err != CL_SUCCESS) {
-            std::cerr << "Error setting argument 0: " << err << std::endl;
-            return 1;
-        }
+    Buffers mem{mem_work, mem_found, mem_index};
 
-        err = clSetKernelArg(kernel_md5rush, 1, sizeof(cl_mem), &mem_found);
-        if (err != CL_SUCCESS) {
-            std::cerr << "Error setting argument 1: " << err << std::endl;
-            return 1;
+    std::string identity = device_identity(device);
+    std::filesystem::path path = tuning_path();
+    std::optional<Launch_config> config;
+    cl_kernel kernel_md5rush = nullptr;
+    if (!tune_only)
+        config = load_tuning(path, identity);
+    if (config) {
+        kernel_md5rush = build_md5rush(context, device, *config);
+        if (kernel_md5rush
+                && !fits_work_group(*config, kernel_md5rush, device)) {
+            clReleaseKernel(kernel_md5rush);
+            kernel_md5rush = nullptr;
         }
-        
-        err = clSetKernelArg(kernel_md5rush, 2, sizeof(cl_mem), &mem_index);
-        if (err != CL_SUCCESS) {
-            std::cerr << "Error setting argument 2: " << err << std::endl;
-            return 1;
+        if (!kernel_md5rush) {
+            std::cerr << "Ignoring tuning " << *config << std::endl;
+            config.reset();
         }
-
-        uint64_t count = std::min(work.count, 0x100000000u);
-        err = clEnqueueNDRangeKernel(cmdqueue, kernel_md5rush, 1,
-                nullptr, &count, nullptr,
-                0, nullptr, nullptr);
-        if (err != CL_SUCCESS) {
-            std::cerr << "Error executing kernel: " << err << std::endl;
+    }
+    if (!config) {
+        std::cerr << "Tuning for " << identity << std::endl;
+        config = tune(context, device, cmdqueue, mem);
+        if (!config) {
+            std::cerr << "Error tuning: no usable configuration" << std::endl;
             return 1;
         }
-
-        err = clEnqueueReadBuffer(cmdqueue, mem_found,
-                CL_TRUE, 0, sizeof(uint32_t), &found,
-                0, nullptr, nullptr);
-        if (err != CL_SUCCESS) {
-            std::cerr << "Error reading buffer 1: " << err << std::endl;
+        save_tuning(path, identity, *config);
+        if (tune_only)
+            return 0;
+        kernel_md5rush = build_md5rush(context, device, *config);
+        if (!kernel_md5rush)
             return 1;
-        }
+    }
+    Scope_exit release_kernel_md5rush([kernel_md5rush] {
+        cl_int err2 = clReleaseKernel(kernel_md5rush);
+        if (err2 != CL_SUCCESS)
+            std::cerr << "Error releasing kernel: " << err2 << std::endl;
+    });
 
-        err = clEnqueueReadBuffer(cmdqueue, mem_index,
-                CL_TRUE, 0, sizeof(uint32_t), &index,
-                0, nullptr, nullptr);
-        if (err != CL_SUCCESS) {
-            std::cerr << "Error reading buffer 2: " << err << std::endl;
+    Work work;
+    while (std::cin >> work) {
+        uint32_t found, index;
+        if (!run_md5rush(cmdqueue, kernel_md5rush, *config, mem, work,
+                    found, index))
             return 1;
-        }
 
         if (found) {
             uint32_t result = work.data[work.mutable_index] + index;
@@ -1,8 +1,22 @@
 #include <algorithm>
 #include <array>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <optional>
+#include <string_view>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
 
 #ifndef MD5RUSH_VECTOR_WIDTH
 #if __AVX512F__
@@ -113,7 +127,9 @@ std::array<vector_t, n> broadcast(const std::array<uint32_t, n> &in) {
     return out;
 }
 
-std::optional<uint32_t> md5rush(const Work &work) {
+// tried is set to the number of messages actually hashed.
+std::optional<uint32_t> md5rush(const Work &work, uint64_t &tried) {
+    tried = 0;
     // Good luck pwning me.
     if (work.mutable_index >= work.data.size())
         return std::nullopt;
@@ -126,7 +142,8 @@ std::optional<uint32_t> md5rush(const Work &work) {
     for (unsigned j = 0; j < vector_width; j++)
         data[work.mutable_index][j] += j;
 
-    for (uint64_t i = 0; i < count; i += vector_width) {
+    uint64_t i = 0;
+    for (; i < count; i += vector_width) {
         std::array<vector_t, 4> new_state = next_state(init_state, data);
         vector_t masked_state =
             (new_state[0] & mask[0]) |
@@ -135,23 +152,218 @@ std::optional<uint32_t> md5rush(const Work &work) {
             (new_state[3] & mask[3]);
         if (may_have_zero(masked_state))
             for (unsigned j = 0; j < vector_width; j++)
-                if (masked_state[j] == 0)
+                if (masked_state[j] == 0) {
+                    tried = i + vector_width;
                     return work.data[work.mutable_index] + i + j;
+                }
         data[work.mutable_index] += vector_width;
     }
+    tried = i;
     return std::nullopt;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+constexpr std::string_view tsc_unit = "tsc";
+#else
+constexpr std::string_view tsc_unit = "ns";
+#endif
+
+// Timestamp counter ticks, or nanoseconds where there is no rdtsc.
+uint64_t read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// User-space cycles and instructions of this thread, read as one group.
+class Perf_counters {
+    int cycles_fd = -1;
+    int instructions_fd = -1;
+
+    static int open_counter(uint64_t config, int group_fd) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = group_fd == -1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+    }
+public:
+    Perf_counters() {
+        cycles_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+        if (cycles_fd == -1)
+            return;
+        instructions_fd = open_counter(PERF_COUNT_HW_INSTRUCTIONS, cycles_fd);
+        if (instructions_fd == -1) {
+            int saved_errno = errno;
+            close(cycles_fd);
+            cycles_fd = -1;
+            errno = saved_errno;
+        }
+    }
+    Perf_counters(const Perf_counters &) = delete;
+    Perf_counters &operator = (const Perf_counters &) = delete;
+    ~Perf_counters() {
+        if (instructions_fd != -1)
+            close(instructions_fd);
+        if (cycles_fd != -1)
+            close(cycles_fd);
+    }
+
+    bool available() const { return cycles_fd != -1; }
+
+    void start() {
+        ioctl(cycles_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    struct Counts {
+        uint64_t cycles;
+        uint64_t instructions;
+        // The group shared the PMU with other events and was only counting
+        // part of the time; cycles and instructions are scaled estimates.
+        bool multiplexed;
+    };
+
+    std::optional<Counts> stop() {
+        ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        // nr, time enabled, time running, cycles, instructions
+        uint64_t values[5];
+        if (read(cycles_fd, values, sizeof(values)) != sizeof(values)
+                || values[0] != 2 || values[2] == 0)
+            return std::nullopt;
+        uint64_t enabled = values[1], running = values[2];
+        if (running >= enabled)
+            return Counts{values[3], values[4], false};
+        double scale = double(enabled) / running;
+        return Counts{uint64_t(values[3] * scale),
+            uint64_t(values[4] * scale), true};
+    }
+};
+
+enum class Profile { none, text, json };
+
+struct Sample {
+    uint64_t hashes;
+    uint64_t tsc;
+    std::optional<Perf_counters::Counts> counters;
+};
+
+// Every MD5 block is 64 steps.
+constexpr unsigned md5_steps = 64;
+
+void report_text(std::ostream &out, const Sample &sample) {
+    out << "profile: " << sample.hashes << " hashes, "
+        << sample.tsc << ' ' << tsc_unit;
+    if (sample.hashes)
+        out << " (" << double(sample.tsc) / sample.hashes << "/hash, "
+            << double(sample.tsc) / sample.hashes / md5_steps << "/step)";
+    if (sample.counters) {
+        auto [cycles, instructions, multiplexed] = *sample.counters;
+        out << ", " << cycles << " cycles, "
+            << instructions << " instructions";
+        if (cycles)
+            out << ", IPC " << double(instructions) / cycles;
+        if (sample.hashes)
+            out << ", " << double(cycles) / sample.hashes << " cycles/hash, "
+                << double(cycles) / sample.hashes / md5_steps
+                << " cycles/step";
+        if (multiplexed)
+            out << " (multiplexed, scaled)";
+    }
+    out << std::endl;
+}
+
+void report_json(std::ostream &out, const Sample &sample) {
+    auto ratio = [&out](uint64_t x, uint64_t y, double scale = 1) {
+        if (y)
+            out << double(x) / y / scale;
+        else
+            out << "null";
+    };
+    out << "{\"hashes\": " << sample.hashes
+        << ", \"" << tsc_unit << "\": " << sample.tsc
+        << ", \"" << tsc_unit << "_per_hash\": ";
+    ratio(sample.tsc, sample.hashes);
+    out << ", \"" << tsc_unit << "_per_step\": ";
+    ratio(sample.tsc, sample.hashes, md5_steps);
+    if (sample.counters) {
+        auto [cycles, instructions, multiplexed] = *sample.counters;
+        out << ", \"cycles\": " << cycles
+            << ", \"instructions\": " << instructions << ", \"ipc\": ";
+        ratio(instructions, cycles);
+        out << ", \"cycles_per_hash\": ";
+        ratio(cycles, sample.hashes);
+        out << ", \"cycles_per_step\": ";
+        ratio(cycles, sample.hashes, md5_steps);
+        out << ", \"multiplexed\": " << (multiplexed ? "true" : "false");
+    } else {
+        out << ", \"cycles\": null, \"instructions\": null, \"ipc\": null"
+            << ", \"cycles_per_hash\": null, \"cycles_per_step\": null"
+            << ", \"multiplexed\": null";
+    }
+    out << "}" << std::endl;
+}
+
+void usage(const char *argv0) {
+    std::cerr << "usage: " << argv0 << " [--profile[=json]]" << std::endl;
 }
 
-int main() {
+}
+
+int main(int argc, char **argv) {
+    Profile profile = Profile::none;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--profile") {
+            profile = Profile::text;
+        } else if (arg == "--profile=json") {
+            profile = Profile::json;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::optional<Perf_counters> counters;
+    if (profile != Profile::none) {
+        counters.emplace();
+        if (!counters->available()) {
+            std::cerr << "perf_event_open: " << std::strerror(errno)
+                << "; profiling with rdtsc only" << std::endl;
+            counters.reset();
+        }
+    }
+
     struct Work work;
     while (std::cin >> work) {
-        std::optional<uint32_t> result = md5rush(work);
+        Sample sample{};
+        if (counters)
+            counters->start();
+        uint64_t tsc = read_tsc();
+        std::optional<uint32_t> result = md5rush(work, sample.hashes);
+        sample.tsc = read_tsc() - tsc;
+        if (counters)
+            sample.counters = counters->stop();
+
         if (result) {
             std::cout << "1 " << *result << std::endl;
         } else {
             std::cout << "0 0" << std::endl;
         }
+
+        if (profile != Profile::none) {
+            if (profile == Profile::json)
+                report_json(std::cerr, sample);
+            else
+                report_text(std::cerr, sample);
+        }
     }
 }